@@ -1,10 +1,11 @@
 #!/bin/bash
 
-# Stop the containers
+# Stop the containers (standby first, so it does not take over from the primary)
+docker stop mtacoin-server-standby
 docker stop mtacoin-server mtacoin-miner-1 mtacoin-miner-2 mtacoin-miner-3
 
 # Remove the containers
-docker rm mtacoin-server mtacoin-miner-1 mtacoin-miner-2 mtacoin-miner-3
+docker rm mtacoin-server mtacoin-server-standby mtacoin-miner-1 mtacoin-miner-2 mtacoin-miner-3
 
 echo "Containers stopped and removed."
 
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Kill the primary server and check that the standby takes over without losing blocks.
+# Usage: ./failover_test.sh [seconds to mine before and after the kill]
+
+RUN_SECONDS=${1:-10}
+LOG_DIR=$(mktemp -d)
+
+# Start from a clean chain
+./cleanup.sh > /dev/null 2>&1
+sudo rm -f /mnt/mta/server_state /mnt/mta/failover.txt
+
+# Run the primary, the standby and the miners
+./launcher.sh || exit 1
+sleep "$RUN_SECONDS"
+
+# Kill the primary without letting it clean up
+docker kill mtacoin-server
+sleep "$RUN_SECONDS"
+
+# Each server logs inside its own container, copy them out before removing the containers
+docker cp mtacoin-server:/var/log/mtacoin.log "$LOG_DIR/primary.log"
+docker cp mtacoin-server-standby:/var/log/mtacoin.log "$LOG_DIR/standby.log"
+./cleanup.sh > /dev/null
+
+# Written by the standby when it takes over (FAILOVER_MS, DETECTED_BY, EPOCH, HEIGHT)
+if [ ! -f /mnt/mta/failover.txt ]; then
+    echo "FAIL: the standby did not take over"
+    exit 1
+fi
+source /mnt/mta/failover.txt
+
+# Heights of the blocks a server accepted
+heights() {
+    grep "New block added" "$@" | sed -n 's/.*height:(\([0-9]*\)).*/\1/p' | sort -n
+}
+
+# Blocks the primary accepted after the last state the standby took over from
+PRIMARY_TOP=$(heights "$LOG_DIR/primary.log" | tail -1)
+LOST=$(( ${PRIMARY_TOP:-0} > HEIGHT ? ${PRIMARY_TOP:-0} - HEIGHT : 0 ))
+
+# Blocks the standby accepted after taking over, none means the miners never resumed
+RESUMED=$(heights "$LOG_DIR/standby.log" | awk -v height="$HEIGHT" '$1 > height { n++ } END { print n + 0 }')
+
+# Over both servers, missing heights and heights accepted twice
+read -r BLOCKS GAPS REPLAYED < <(heights "$LOG_DIR/primary.log" "$LOG_DIR/standby.log" | awk '
+    NR > 1 && $1 == prev { replayed++ }
+    NR > 1 && $1 > prev + 1 { gaps += $1 - prev - 1 }
+    { prev = $1 }
+    END { print NR, gaps + 0, replayed + 0 }')
+
+echo "Failover time:     $FAILOVER_MS ms (detected by $DETECTED_BY)"
+echo "Takeover height:   $HEIGHT (primary reached ${PRIMARY_TOP:-0})"
+echo "Blocks accepted:   $BLOCKS"
+echo "Mined on standby:  $RESUMED"
+echo "Blocks lost:       $LOST"
+echo "Height gaps:       $GAPS"
+echo "Replayed heights:  $REPLAYED"
+echo "Logs are in $LOG_DIR"
+
+if [ "$RESUMED" -eq 0 ] || [ "$LOST" -ne 0 ] || [ "$GAPS" -ne 0 ] || [ "$REPLAYED" -ne 0 ]; then
+    echo "FAIL"
+    exit 1
+fi
+echo "PASS"
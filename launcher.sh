@@ -8,19 +8,24 @@ sudo chmod 777 /mnt/mta
 cp mtacoin.conf /mnt/mta/
 sudo chmod 777 /mnt/mta/mtacoin.conf
 
-# Pull the Docker images from Docker Hub
-docker pull naorb12/linux-assigment3:server
-docker pull naorb12/linux-assigment3:miner
+# Build the binaries and the Docker images from this checkout
+# (the images on Docker Hub predate the standby server)
+make || exit 1
+docker build -t mtacoin:server -f Dockerfile.server . || exit 1
+docker build -t mtacoin:miner -f Dockerfile.miner . || exit 1
 
 # Run the server container
-docker run -d --name mtacoin-server -v /mnt/mta:/mnt/mta naorb12/linux-assigment3:server
+docker run -d --name mtacoin-server -v /mnt/mta:/mnt/mta mtacoin:server
 
 # Wait for the server to initialize
 sleep 1
 
+# Run a standby server, it takes over the server pipe if the primary dies
+docker run -d --name mtacoin-server-standby -v /mnt/mta:/mnt/mta mtacoin:server
+
 # Run multiple miner containers
 for i in {1..3}; do
-    docker run -d --name mtacoin-miner-$i -v /mnt/mta:/mnt/mta naorb12/linux-assigment3:miner
+    docker run -d --name mtacoin-miner-$i -v /mnt/mta:/mnt/mta mtacoin:miner
 done
 
 echo "Server and miner containers are running."
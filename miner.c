@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <zlib.h>
@@ -12,6 +13,10 @@
 #include <time.h>
 #include <signal.h>
 #include <syslog.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #define MAX 256
 
@@ -51,17 +56,84 @@ typedef struct {
 
 int first_block = 0;
 int fd_Miner;
+int miner_id;
+
+// How long to wait for a (standby) server to take over the server pipe
+#define SERVER_RECONNECT_TIMEOUT_MS 5000
+#define SERVER_RECONNECT_POLL_MS 10
+#define SUBMIT_ATTEMPTS 3
+
+// Startup calibration, the result is cached per host (CPU count) in the shared directory
+const char* TUNING_FILE = "/mnt/mta/tuning.conf";
+const char* TUNING_LOCK_FILE = "/mnt/mta/tuning.lock";
+
+#define CALIBRATION_RUN_MS 200
+#define DEFAULT_BATCH_SIZE 64
+#define TEMPLATE_POLL_MS 10
+#define CPU_CHECK_MS 1000
+
+typedef enum {
+    AFFINITY_NONE = 0,      // let the scheduler place the threads
+    AFFINITY_SPREAD = 1,    // one thread per physical core before using SMT siblings
+    AFFINITY_PACK = 2       // fill SMT siblings of a core before moving on
+} AFFINITY;
+
+const char* AFFINITY_NAMES[] = { "none", "spread", "pack" };
+
+// Mining configuration chosen by the calibration
+typedef struct {
+    int cpus;
+    int threads;
+    int batch_size;
+    int affinity;
+    long hashrate;
+} Tuning_t;
+
+// Mining worker thread
+typedef struct {
+    pthread_t thread;
+    int index;
+    int cpu;            // CPU to pin to, -1 for no pinning
+    bool submit;        // false while calibrating
+    Tuning_t* tuning;
+    unsigned long hashes;
+} Worker_t;
+
+// Block the workers are mining on, replaced when the server sends a new one
+pthread_mutex_t block_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t submit_mutex = PTHREAD_MUTEX_INITIALIZER;
+Block_t template_block;
+bool template_valid = false;    // false until the server sends a block
+atomic_int template_gen = 0;    // bumped on every change of the two above
+atomic_int solved_gen = 0;      // last template a worker submitted a block for
+atomic_bool workers_stop = false;
 
 // Function prototypes
 bool verify_difficulty(unsigned int hash, int diff);
 unsigned int calc_hash(Block_t* block);
 int get_next_miner_id();
 void signal_handler(int signum);
+int open_server_pipe(int miner_id, bool* reconnected);
+int send_connection_request(int pipe_fd_Server, int miner_id);
+bool submit_block(Block_t* block);
+
+int count_cpus(int* cpus);
+int read_topology(int cpu, const char* name);
+int cpu_order(int affinity, int* order);
+Worker_t* start_workers(Tuning_t* tuning, bool submit);
+unsigned long stop_workers(Worker_t* workers, int threads);
+void* mine_worker(void* arg);
+long measure_hashrate(Tuning_t* tuning);
+void calibrate(Tuning_t* tuning);
+bool load_tuning(Tuning_t* tuning, int cpus);
+void save_tuning(Tuning_t* tuning);
+void get_tuning(Tuning_t* tuning, bool contended);
+void set_template(Block_t* block);
 
 void print_block(Block_t* block);
 
 TLV* readTlvFromPipe(int pipeReadEnd);
-void writeTlvToPipe(int pipeWriteEnd, TLV* tlv);
+int writeTlvToPipe(int pipeWriteEnd, TLV* tlv);
 
 // Log file pointer
 FILE *log_file;
@@ -70,15 +142,20 @@ FILE *log_file;
 void log_message(const char *format, ...) {
     va_list args;
     va_start(args, format);
+    flockfile(log_file);
     vfprintf(log_file, format, args);
     fprintf(log_file, "\n");
     fflush(log_file);
+    funlockfile(log_file);
     va_end(args);
 }
 
 int main(int argc, char* argv[]) {
     srand(time(NULL));
 
+    // A reader that goes away mid-write must not kill us, write() returns EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
      // Open log file
     log_file = fopen("/var/log/mtacoin.log", "a");
     if (!log_file) {
@@ -86,7 +163,7 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    int miner_id = get_next_miner_id();
+    miner_id = get_next_miner_id();
     char path[256];
 
     snprintf(path, sizeof(path), "/mnt/mta/miner_%d", miner_id);
@@ -104,21 +181,7 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    char miner_id_str[32];
-    snprintf(miner_id_str, sizeof(miner_id_str), "%d", miner_id);
-    TLV tlv = { NEW_MINER, strlen(miner_id_str) + 1, {0} }; 
-    strncpy(tlv.value, miner_id_str, sizeof(tlv.value) - 1);
-    
-    int pipe_fd_Server = open("/mnt/mta/server_pipe", O_WRONLY);
-    if (pipe_fd_Server == -1) {
-        log_message("Miner: Error opening server pipe");
-        exit(EXIT_FAILURE);
-    }
-    writeTlvToPipe(pipe_fd_Server, &tlv);
-    close(pipe_fd_Server);
-
-    log_message("Miner %d sent connection request on %s\n", miner_id, path);
-
+    // Open our end before registering, the server doesn't wait for a reader
     fd_Miner = open(path, O_RDONLY | O_NONBLOCK);
     if (fd_Miner == -1) {
         log_message("Error opening named pipe");
@@ -130,17 +193,59 @@ int main(int argc, char* argv[]) {
     flags |= O_NONBLOCK; /* Enable O_NONBLOCK bit */
     fcntl(fd_Miner, F_SETFL, flags); /* Update open files status flags */
 
+    // Pick threads, batch size and affinity for this host before mining
+    Tuning_t tuning;
+    get_tuning(&tuning, false);
+
+    bool reconnected = false;
+    int pipe_fd_Server = open_server_pipe(miner_id, &reconnected);
+    if (pipe_fd_Server == -1) {
+        log_message("Miner: Error opening server pipe");
+        exit(EXIT_FAILURE);
+    }
+    send_connection_request(pipe_fd_Server, miner_id);
+    close(pipe_fd_Server);
+
+    log_message("Miner %d sent connection request on %s\n", miner_id, path);
+
     // Set up signal handlers
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGHUP, signal_handler);
 
     Block_t* next_block = (Block_t*)malloc(sizeof(Block_t));
+    Worker_t* workers = start_workers(&tuning, true);
+    struct timespec poll = { 0, TEMPLATE_POLL_MS * 1000000L };
+    int polls_since_cpu_check = 0;
 
+    // The workers do the hashing, this thread only hands them new blocks
     while (true) 
     {
+        // Recalibrate if our CPUs changed under us (e.g. docker update --cpuset-cpus)
+        if (++polls_since_cpu_check * TEMPLATE_POLL_MS >= CPU_CHECK_MS) 
+        {
+            polls_since_cpu_check = 0;
+            int cpus[CPU_SETSIZE];
+            int cpu_count = count_cpus(cpus);
+            if (cpu_count != tuning.cpus) 
+            {
+                log_message("Miner #%d: CPU count changed from %d to %d\n", miner_id, tuning.cpus, cpu_count);
+                stop_workers(workers, tuning.threads);
+                // Other miners are hashing now, so don't cache what we measure for them
+                get_tuning(&tuning, true);
+                set_template(first_block ? next_block : NULL);
+                workers = start_workers(&tuning, true);
+            }
+        }
+
         TLV* new_tlv = readTlvFromPipe(fd_Miner);
-        if (new_tlv != NULL && new_tlv->type == NEW_BLOCK) 
+        if (new_tlv == NULL) 
+        {
+            nanosleep(&poll, NULL);
+            continue;
+        }
+
+        if (new_tlv->type == NEW_BLOCK) 
         {
             first_block = 1;
             memcpy(next_block, new_tlv->value, sizeof(Block_t));
@@ -153,36 +258,11 @@ int main(int argc, char* argv[]) {
             next_block->nonce = 0;
             next_block->prev_hash = next_block->hash;
             next_block->timestamp = (int)time(NULL);
-            
-            free(new_tlv);
-        } 
 
-        next_block->timestamp = (int)time(NULL);
-        unsigned int hash = calc_hash(next_block);
-
-        if (verify_difficulty(hash, next_block->difficulty)) 
-        {
-            next_block->hash = hash;
-
-            TLV new_block_tlv;
-            new_block_tlv.type = NEW_BLOCK;
-            new_block_tlv.length = sizeof(Block_t);
-            memcpy(new_block_tlv.value, next_block, sizeof(Block_t));
-
-            pipe_fd_Server = open("/mnt/mta/server_pipe", O_WRONLY);
-            if (pipe_fd_Server == -1) 
-            {
-                log_message("Miner: Error opening server pipe");
-                continue;
-            }
-
-            log_message(ANSI_COLOR_YELLOW "Miner #%d: " ANSI_COLOR_RESET "Mined a new block #%d, with the hash 0x%x\n", next_block->relayed_by, next_block->height, next_block->hash);
-
-            writeTlvToPipe(pipe_fd_Server, &new_block_tlv);
-            close(pipe_fd_Server);
-        }
+            set_template(next_block);
+        } 
 
-        next_block->nonce++;
+        free(new_tlv);
     }
 
     free(next_block);
@@ -231,12 +311,17 @@ TLV* readTlvFromPipe(int pipeReadEnd) {
     return tlv;
 }
 
-// Serialize TLV to pipe
-void writeTlvToPipe(int pipeWriteEnd, TLV* tlv) {
+// Serialize TLV to pipe, returns the write() result
+int writeTlvToPipe(int pipeWriteEnd, TLV* tlv) {
     int len = 0;
 
     len = write(pipeWriteEnd, (void*)tlv, sizeof(tlv->type) + sizeof(tlv->length) + tlv->length);
-    if (len < 0) { log_message("type + length + value"); return; }
+    if (len < 0) {
+        int saved_errno = errno;
+        log_message("type + length + value");
+        errno = saved_errno;
+    }
+    return len;
 }
 
 void print_block(Block_t* block) {
@@ -269,6 +354,88 @@ int get_next_miner_id() {
     return next_id;
 }
 
+// Open the server pipe, waiting for a standby server to take over if nobody is reading it.
+// Sets *reconnected when the server was unavailable and had to be waited for.
+int open_server_pipe(int miner_id, bool* reconnected) {
+    *reconnected = false;
+    struct timespec poll = { 0, SERVER_RECONNECT_POLL_MS * 1000000L };
+
+    for (int waited = 0; waited < SERVER_RECONNECT_TIMEOUT_MS; waited += SERVER_RECONNECT_POLL_MS) {
+        // Non-blocking so a dead server fails with ENXIO instead of hanging the miner
+        int fd = open("/mnt/mta/server_pipe", O_WRONLY | O_NONBLOCK);
+        if (fd != -1) {
+            int flags = fcntl(fd, F_GETFL);
+            fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+            if (*reconnected) {
+                log_message(ANSI_COLOR_YELLOW "Miner #%d: " ANSI_COLOR_RESET "reconnected to server after %d ms\n", miner_id, waited);
+            }
+            return fd;
+        }
+        if (errno != ENXIO && errno != ENOENT) {
+            return -1;
+        }
+        if (!*reconnected) {
+            log_message(ANSI_COLOR_YELLOW "Miner #%d: " ANSI_COLOR_RESET "server is not available, waiting for it...\n", miner_id);
+            *reconnected = true;
+        }
+        nanosleep(&poll, NULL);
+    }
+    return -1;
+}
+
+// Send a mined block to the server, called from the worker threads.
+// Retries when the server dies mid-write, returns false if the block couldn't be sent.
+bool submit_block(Block_t* block) {
+    TLV new_block_tlv;
+    new_block_tlv.type = NEW_BLOCK;
+    new_block_tlv.length = sizeof(Block_t);
+    memcpy(new_block_tlv.value, block, sizeof(Block_t));
+
+    pthread_mutex_lock(&submit_mutex);
+
+    bool sent = false;
+    bool server_lost = false;
+    for (int attempt = 0; attempt < SUBMIT_ATTEMPTS && !sent; attempt++) 
+    {
+        bool reconnected = false;
+        int pipe_fd_Server = open_server_pipe(miner_id, &reconnected);
+        if (pipe_fd_Server == -1) 
+        {
+            log_message("Miner: Error opening server pipe");
+            break;
+        }
+
+        if (attempt == 0) {
+            log_message(ANSI_COLOR_YELLOW "Miner #%d: " ANSI_COLOR_RESET "Mined a new block #%d, with the hash 0x%x\n", block->relayed_by, block->height, block->hash);
+        }
+
+        sent = writeTlvToPipe(pipe_fd_Server, &new_block_tlv) >= 0;
+        if (!sent && errno != EPIPE) 
+        {
+            close(pipe_fd_Server);
+            break;
+        }
+        server_lost = server_lost || reconnected || !sent;
+
+        // The server changed under us, register again to get its current block
+        if (sent && server_lost) {
+            send_connection_request(pipe_fd_Server, miner_id);
+        }
+        close(pipe_fd_Server);
+    }
+
+    pthread_mutex_unlock(&submit_mutex);
+    return sent;
+}
+
+// Ask the server to register us and send the block to mine on
+int send_connection_request(int pipe_fd_Server, int miner_id) {
+    char miner_id_str[32];
+    snprintf(miner_id_str, sizeof(miner_id_str), "%d", miner_id);
+    TLV tlv = { NEW_MINER, strlen(miner_id_str) + 1, {0} }; 
+    strncpy(tlv.value, miner_id_str, sizeof(tlv.value) - 1);
+    return writeTlvToPipe(pipe_fd_Server, &tlv);
+}
 // Signal handler
 void signal_handler(int signum) {
     log_message("Received signal %d, cleaning up and exiting...\n", signum);
@@ -277,3 +444,340 @@ void signal_handler(int signum) {
     }
     exit(signum);
 }
+
+// Number of CPUs we may run on, fills cpus with their ids
+int count_cpus(int* cpus) {
+    cpu_set_t set;
+    int count = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+        cpus[0] = 0;
+        return 1;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[count++] = cpu;
+        }
+    }
+    return count;
+}
+
+// Read a CPU topology value from sysfs, -1 if not available
+int read_topology(int cpu, const char* name) {
+    char path[MAX];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int value = -1;
+    if (fscanf(file, "%d", &value) != 1) {
+        value = -1;
+    }
+    fclose(file);
+    return value;
+}
+
+// Order the CPUs for pinning, thread i runs on order[i % count]
+int cpu_order(int affinity, int* order) {
+    int cpus[CPU_SETSIZE];
+    int count = count_cpus(cpus);
+
+    // Key each CPU by (package, core) so SMT siblings share a key
+    long keys[CPU_SETSIZE];
+    for (int i = 0; i < count; i++) {
+        int package = read_topology(cpus[i], "physical_package_id");
+        int core = read_topology(cpus[i], "core_id");
+        keys[i] = core < 0 ? cpus[i] : (long)(package < 0 ? 0 : package) * 65536 + core;
+    }
+
+    int n = 0;
+    if (affinity == AFFINITY_PACK) {
+        // Siblings next to each other
+        bool used[CPU_SETSIZE] = { false };
+        for (int i = 0; i < count; i++) {
+            if (used[i]) continue;
+            for (int j = i; j < count; j++) {
+                if (!used[j] && keys[j] == keys[i]) {
+                    order[n++] = cpus[j];
+                    used[j] = true;
+                }
+            }
+        }
+    } else {
+        // First CPU of every core, then the second, and so on
+        int round[CPU_SETSIZE];
+        for (int i = 0; i < count; i++) {
+            round[i] = 0;
+            for (int j = 0; j < i; j++) {
+                if (keys[j] == keys[i]) round[i]++;
+            }
+        }
+        for (int r = 0; n < count; r++) {
+            for (int i = 0; i < count; i++) {
+                if (round[i] == r) order[n++] = cpus[i];
+            }
+        }
+    }
+    return n;
+}
+
+// Start the mining threads for a configuration.
+// The launcher runs several miners per host, so each miner starts at its own
+// offset in the CPU order instead of all of them pinning to the first CPUs.
+Worker_t* start_workers(Tuning_t* tuning, bool submit) {
+    int order[CPU_SETSIZE];
+    int count = cpu_order(tuning->affinity, order);
+    int offset = (miner_id - 1) * tuning->threads;
+
+    atomic_store(&workers_stop, false);
+    Worker_t* workers = (Worker_t*)calloc(tuning->threads, sizeof(Worker_t));
+    for (int i = 0; i < tuning->threads; i++) {
+        workers[i].index = i;
+        workers[i].cpu = tuning->affinity == AFFINITY_NONE ? -1 : order[(offset + i) % count];
+        workers[i].submit = submit;
+        workers[i].tuning = tuning;
+        if (pthread_create(&workers[i].thread, NULL, mine_worker, &workers[i]) != 0) {
+            log_message("Error creating mining thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return workers;
+}
+
+// Stop and free the mining threads, returns the number of hashes they did
+unsigned long stop_workers(Worker_t* workers, int threads) {
+    unsigned long hashes = 0;
+    atomic_store(&workers_stop, true);
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        hashes += workers[i].hashes;
+    }
+    free(workers);
+    return hashes;
+}
+
+// Mine the current block, checking for a new one after every batch of nonces.
+// Each worker takes every threads-th batch so they never hash the same nonce.
+void* mine_worker(void* arg) {
+    Worker_t* worker = (Worker_t*)arg;
+    int threads = worker->tuning->threads;
+    int batch_size = worker->tuning->batch_size;
+
+    if (worker->cpu != -1) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            log_message("Miner #%d: Error pinning mining thread to CPU %d (%s), running unpinned\n", miner_id, worker->cpu, strerror(err));
+        }
+    }
+
+    struct timespec poll = { 0, TEMPLATE_POLL_MS * 1000000L };
+    Block_t block;
+    bool valid = false;
+    int gen = 0;
+    int nonce = 0;
+
+    while (!atomic_load(&workers_stop)) 
+    {
+        if (atomic_load(&template_gen) != gen) 
+        {
+            pthread_mutex_lock(&block_mutex);
+            memcpy(&block, &template_block, sizeof(Block_t));
+            valid = template_valid;
+            gen = atomic_load(&template_gen);
+            pthread_mutex_unlock(&block_mutex);
+            nonce = worker->index * batch_size;
+        }
+
+        // No block from the server yet, or already solved and waiting for the next one
+        if (!valid || atomic_load(&solved_gen) == gen) 
+        {
+            nanosleep(&poll, NULL);
+            continue;
+        }
+
+        block.timestamp = (int)time(NULL);
+        for (int i = 0; i < batch_size; i++) 
+        {
+            block.nonce = nonce + i;
+            unsigned int hash = calc_hash(&block);
+
+            if (worker->submit && verify_difficulty(hash, block.difficulty)) 
+            {
+                // Only the first worker to solve a template submits it, the rest stop mining it
+                int previous = atomic_exchange(&solved_gen, gen);
+                if (previous != gen) 
+                {
+                    block.hash = hash;
+                    if (!submit_block(&block)) {
+                        // Not sent, keep mining this template
+                        int solved = gen;
+                        atomic_compare_exchange_strong(&solved_gen, &solved, previous);
+                    }
+                }
+                break;
+            }
+        }
+
+        worker->hashes += batch_size;
+        nonce += threads * batch_size;
+    }
+    return NULL;
+}
+
+// Hashes per second of a configuration, mining a dummy block for a short while
+long measure_hashrate(Tuning_t* tuning) {
+    Block_t block = { 1, (int)time(NULL), 0, 0x12345678, 32, 0, miner_id };
+    set_template(&block);
+
+    struct timespec run = { CALIBRATION_RUN_MS / 1000, (CALIBRATION_RUN_MS % 1000) * 1000000L };
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Worker_t* workers = start_workers(tuning, false);
+    nanosleep(&run, NULL);
+    unsigned long hashes = stop_workers(workers, tuning->threads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    set_template(NULL);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long hashrate = (long)(hashes / seconds);
+    log_message("Miner: calibration threads (%d), batch size (%d), affinity (%s): %ld hashes/s\n"
+    , tuning->threads, tuning->batch_size, AFFINITY_NAMES[tuning->affinity], hashrate);
+    return hashrate;
+}
+
+// Search one knob at a time (threads, then batch size, then affinity), keeping
+// the best of each, instead of every combination to keep startup short
+void calibrate(Tuning_t* tuning) {
+    tuning->threads = 1;
+    tuning->batch_size = DEFAULT_BATCH_SIZE;
+    tuning->affinity = AFFINITY_NONE;
+    tuning->hashrate = 0;
+
+    Tuning_t trial = *tuning;
+    for (int threads = 1; ; threads = threads * 2 < tuning->cpus ? threads * 2 : tuning->cpus) {
+        trial.threads = threads;
+        long hashrate = measure_hashrate(&trial);
+        if (hashrate > tuning->hashrate) {
+            tuning->threads = threads;
+            tuning->hashrate = hashrate;
+        }
+        if (threads == tuning->cpus) break;
+    }
+
+    int batch_sizes[] = { 1, 16, 256, 4096 };
+    trial = *tuning;
+    for (int i = 0; i < (int)(sizeof(batch_sizes) / sizeof(batch_sizes[0])); i++) {
+        if (batch_sizes[i] == DEFAULT_BATCH_SIZE) continue;
+        trial.batch_size = batch_sizes[i];
+        long hashrate = measure_hashrate(&trial);
+        if (hashrate > tuning->hashrate) {
+            tuning->batch_size = batch_sizes[i];
+            tuning->hashrate = hashrate;
+        }
+    }
+
+    trial = *tuning;
+    for (int affinity = AFFINITY_SPREAD; affinity <= AFFINITY_PACK; affinity++) {
+        trial.affinity = affinity;
+        long hashrate = measure_hashrate(&trial);
+        if (hashrate > tuning->hashrate) {
+            tuning->affinity = affinity;
+            tuning->hashrate = hashrate;
+        }
+    }
+}
+
+// Read the cached tuning, returns false if there is none for this CPU count
+bool load_tuning(Tuning_t* tuning, int cpus) {
+    FILE* file = fopen(TUNING_FILE, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    Tuning_t cached = { -1, -1, -1, -1, 0 };
+    char line[MAX];
+    char affinity[32] = "";
+    while (fgets(line, sizeof(line), file)) {
+        sscanf(line, "CPUS=%d", &cached.cpus);
+        sscanf(line, "THREADS=%d", &cached.threads);
+        sscanf(line, "BATCH_SIZE=%d", &cached.batch_size);
+        sscanf(line, "AFFINITY=%31s", affinity);
+        sscanf(line, "HASHRATE=%ld", &cached.hashrate);
+    }
+    fclose(file);
+
+    for (int i = AFFINITY_NONE; i <= AFFINITY_PACK; i++) {
+        if (strcmp(affinity, AFFINITY_NAMES[i]) == 0) {
+            cached.affinity = i;
+        }
+    }
+
+    if (cached.cpus != cpus || cached.threads < 1 || cached.threads > cpus || cached.batch_size < 1 || cached.affinity < 0) {
+        return false;
+    }
+    *tuning = cached;
+    return true;
+}
+
+// Cache the tuning for the next miners on this host
+void save_tuning(Tuning_t* tuning) {
+    FILE* file = fopen(TUNING_FILE, "w");
+    if (file == NULL) {
+        log_message("Error opening tuning file");
+        return;
+    }
+    fprintf(file, "CPUS=%d\n", tuning->cpus);
+    fprintf(file, "THREADS=%d\n", tuning->threads);
+    fprintf(file, "BATCH_SIZE=%d\n", tuning->batch_size);
+    fprintf(file, "AFFINITY=%s\n", AFFINITY_NAMES[tuning->affinity]);
+    fprintf(file, "HASHRATE=%ld\n", tuning->hashrate);
+    fclose(file);
+}
+
+// Use the cached tuning, or calibrate if there is none or the CPU count changed.
+// Calibration is done under a lock so miners starting together don't measure each other.
+// A contended calibration (other miners already hashing) is used but not cached.
+void get_tuning(Tuning_t* tuning, bool contended) {
+    int cpus[CPU_SETSIZE];
+    int cpu_count = count_cpus(cpus);
+
+    int fd_Lock = open(TUNING_LOCK_FILE, O_RDWR | O_CREAT, 0666);
+    if (fd_Lock != -1) {
+        flock(fd_Lock, LOCK_EX);
+    }
+
+    if (load_tuning(tuning, cpu_count)) {
+        log_message("Miner #%d: using cached tuning\n", miner_id);
+    } else {
+        log_message("Miner #%d: calibrating for %d CPUs...\n", miner_id, cpu_count);
+        tuning->cpus = cpu_count;
+        calibrate(tuning);
+        if (contended) {
+            log_message("Miner #%d: calibrated while other miners were running, not caching the result\n", miner_id);
+        } else {
+            save_tuning(tuning);
+        }
+    }
+
+    if (fd_Lock != -1) {
+        close(fd_Lock);
+    }
+
+    log_message(ANSI_COLOR_YELLOW "Miner #%d: " ANSI_COLOR_RESET "tuning: CPUs (%d), threads (%d), batch size (%d), affinity (%s), hashrate (%ld hashes/s)\n"
+    , miner_id, tuning->cpus, tuning->threads, tuning->batch_size, AFFINITY_NAMES[tuning->affinity], tuning->hashrate);
+}
+
+// Hand a block to the workers, NULL to have them wait for one
+void set_template(Block_t* block) {
+    pthread_mutex_lock(&block_mutex);
+    if (block != NULL) {
+        memcpy(&template_block, block, sizeof(Block_t));
+    }
+    template_valid = block != NULL;
+    atomic_fetch_add(&template_gen, 1);
+    pthread_mutex_unlock(&block_mutex);
+}
@@ -11,6 +11,7 @@
 #include <signal.h>
 #include <dirent.h>
 #include <syslog.h>
+#include <sys/file.h>
 
 
 #define MAX 256
@@ -39,6 +40,28 @@ const int READ_END = 0;
 const int WRITE_END = 1;
 
 int fd_Server;
+int fd_Lock = -1;
+int fd_State_Lock = -1;
+int fd_Standby_Lock = -1;
+bool is_primary = false;
+bool has_lease = false;
+int server_epoch = 0;
+
+// Set by a standby when it takes over: last time the primary was known alive, and how we noticed it wasn't
+long primary_alive_ms = -1;
+const char* detected_by = "";
+
+// Lease and replicated state shared between the primary and a standby server
+const char* LOCK_FILE = "/mnt/mta/server.lock";
+const char* STANDBY_LOCK_FILE = "/mnt/mta/server_standby.lock";
+const char* STATE_FILE = "/mnt/mta/server_state";
+const char* STATE_TMP_FILE = "/mnt/mta/server_state.tmp";
+const char* STATE_LOCK_FILE = "/mnt/mta/server_state.lock";
+const char* FAILOVER_FILE = "/mnt/mta/failover.txt";
+
+#define HEARTBEAT_INTERVAL_MS 100
+#define HEARTBEAT_TIMEOUT_MS 500
+#define STANDBY_POLL_MS 10
 
 typedef enum {
     NEW_MINER = 1,
@@ -51,6 +74,15 @@ typedef struct TLV {
     char value[1024];
 } TLV;
 
+// State replicated from the primary to the standby
+typedef struct {
+    long heartbeat_ms;
+    int epoch;          // bumped by every takeover, an older primary seeing a newer epoch steps down
+    int miners_Count;
+    Block_t current_block;
+    Block_t next_block;
+} ServerState_t;
+
 // Function prototypes
 Block_t* Initialize_genesis_block(int diff);
 bool verify_difficulty(unsigned int hash, int diff);
@@ -59,12 +91,26 @@ unsigned int calc_hash(Block_t* block);
 void print_block(Block_t* block);
 
 TLV* readTlvFromPipe(int pipeReadEnd);
-void writeTlvToPipe(int pipeWriteEnd, TLV* tlv);
+int writeTlvToPipe(int pipeWriteEnd, TLV* tlv);
 
 void cleanup_pipes();
 void signal_handler(int signum);
 int read_difficulty_from_file(const char* filepath);
 
+long now_ms();
+bool acquire_primary_lease();
+bool standby_waiting();
+bool load_state(ServerState_t* state);
+void lock_state();
+void unlock_state();
+void write_state(ServerState_t* state);
+bool claim_state(ServerState_t* state);
+bool is_fenced();
+void step_down(TLV* pending);
+bool save_state(Block_t* current_block, Block_t* next_block, int miners_Count);
+void broadcast_block(Block_t* block, int miners_Count);
+void write_failover_report(long failover_ms, int height);
+
 // Log file pointer
 FILE *log_file;
 
@@ -122,6 +168,33 @@ int main(int argc, char* argv[])
         }
     }
 
+    // Set up signal handlers
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGHUP, signal_handler);
+
+    // A reader that goes away mid-write must not kill us, write() returns EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    // Blocks here while another server holds the lease (standby mode)
+    bool took_over = acquire_primary_lease();
+
+    // Resume from the replicated chain tip and miner registry, if any
+    ServerState_t state;
+    bool resumed = claim_state(&state) && state.current_block.difficulty == difficulty;
+
+    // Only stop announcing a standby once the old primary is fenced
+    if (fd_Standby_Lock != -1) {
+        close(fd_Standby_Lock);
+        fd_Standby_Lock = -1;
+    }
+    if (resumed) {
+        memcpy(current_block, &state.current_block, sizeof(Block_t));
+        memcpy(next_block, &state.next_block, sizeof(Block_t));
+        miners_Count = state.miners_Count;
+        log_message("Resuming chain at height %d with %d miners\n", current_block->height, miners_Count);
+    }
+
     fd_Server = open("/mnt/mta/server_pipe", O_RDONLY | O_NONBLOCK);
     if (fd_Server == -1) {
         log_message("Error opening named pipe");
@@ -133,18 +206,48 @@ int main(int argc, char* argv[])
     flags |= O_NONBLOCK; /* Enable O_NONBLOCK bit */
     fcntl(fd_Server, F_SETFL, flags); /* Update open files status flags */
 
-    // Set up signal handlers
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-    signal(SIGHUP, signal_handler);
+    // Reattach miners that were mining on the previous server's template
+    if (resumed) {
+        broadcast_block(next_block, miners_Count);
+    }
+
+    // Time from the primary's last sign of life until miners have our block again
+    if (took_over) {
+        long failover_ms = now_ms() - primary_alive_ms;
+        log_message(ANSI_COLOR_YELLOW "Server:" ANSI_COLOR_RESET "Standby took over as primary in %ld ms (detected by %s), chain tip height %d\n"
+        , failover_ms, detected_by, current_block->height);
+        write_failover_report(failover_ms, current_block->height);
+    }
+
+    if (!save_state(current_block, next_block, miners_Count)) {
+        step_down(NULL);
+    }
+    long last_heartbeat = now_ms();
 
     log_message("Listening on /mnt/mta/server_pipe \n");
     // Handle incoming messages and manage miners
     while (true) 
     {
+        if (now_ms() - last_heartbeat >= HEARTBEAT_INTERVAL_MS) {
+            if (!save_state(current_block, next_block, miners_Count)) {
+                step_down(NULL);
+            }
+            last_heartbeat = now_ms();
+
+            // Took over from a hung primary, pick up the lease once it is gone
+            if (!has_lease && flock(fd_Lock, LOCK_EX | LOCK_NB) == 0) {
+                has_lease = true;
+            }
+        }
+
         TLV* tlv = readTlvFromPipe(fd_Server);
         if (tlv == NULL) continue;
 
+        // We were hung and a standby took over, leave the message to it
+        if (is_fenced()) {
+            step_down(tlv);
+        }
+
         if (tlv->type == NEW_MINER) 
         {
             char miner_id_str[32];
@@ -152,24 +255,34 @@ int main(int argc, char* argv[])
             int miner_id = atoi(miner_id_str);
             char miner_pipe[32];
             sprintf(miner_pipe, "/mnt/mta/miner_%d", miner_id);
-            miners_Count++;
+
+            // Miners re-register after a failover, so track the highest id rather than counting requests
+            if (miner_id > miners_Count) {
+                miners_Count = miner_id;
+                if (!save_state(current_block, next_block, miners_Count)) {
+                    step_down(tlv);
+                }
+            }
 
             // Print new miner 
             log_message("Received connection request from %d, pipe name /mnt/mta/miner_%d \n", miner_id, miner_id);
 
-            int fd_Miner = open(miner_pipe, O_WRONLY);
+            // Non-blocking so a miner that died before opening its pipe can't hang the server
+            int fd_Miner = open(miner_pipe, O_WRONLY | O_NONBLOCK);
             if (fd_Miner == -1) 
             {
                 log_message("Server: Error opening miner pipe");
             }
+            else 
+            {
+                TLV new_block_tlv;
+                new_block_tlv.type = NEW_BLOCK;
+                new_block_tlv.length = sizeof(Block_t);
+                memcpy(new_block_tlv.value, next_block, sizeof(Block_t)); 
 
-            TLV new_block_tlv;
-            new_block_tlv.type = NEW_BLOCK;
-            new_block_tlv.length = sizeof(Block_t);
-            memcpy(new_block_tlv.value, next_block, sizeof(Block_t)); 
-
-            writeTlvToPipe(fd_Miner, &new_block_tlv);
-            close(fd_Miner);
+                writeTlvToPipe(fd_Miner, &new_block_tlv);
+                close(fd_Miner);
+            }
 
 
         } 
@@ -179,9 +292,6 @@ int main(int argc, char* argv[])
 
             if (verify_block(current_block, temp_Block)) 
             {
-                log_message(ANSI_COLOR_YELLOW "Server:" ANSI_COLOR_RESET "New block added by %d, attributes: height:(%d), timestamp:(%d), hash:(0x%x), prev-hash:(0x%x), difficulty:(%d), nonce:(%d)\n"
-                , temp_Block->relayed_by, temp_Block->height, temp_Block->timestamp, temp_Block->hash, temp_Block->prev_hash, temp_Block->difficulty, temp_Block->nonce);
-                
                 // Save block mined (temp) to be current, for new round 
                 free(current_block);
                 current_block = (Block_t*)malloc(sizeof(Block_t));
@@ -201,33 +311,18 @@ int main(int argc, char* argv[])
                 next_block->relayed_by = temp_Block->relayed_by;
                 next_block->timestamp = temp_Block->timestamp;
 
-                // Broadcast new block 
-                TLV new_block_tlv;
-                new_block_tlv.type = NEW_BLOCK;
-                new_block_tlv.length = sizeof(Block_t);
-                memcpy(new_block_tlv.value, next_block, sizeof(Block_t));
-
-                for (int i = 1; i <= miners_Count; i++) 
-                {
-                    char miner_pipe[32];
-                    sprintf(miner_pipe, "/mnt/mta/miner_%d", i);
-                    int fd_Miner = open(miner_pipe, O_WRONLY | O_NONBLOCK);
-                     if (fd_Miner == -1) 
-                        {
-                            if (errno == ENXIO) {
-                                // The pipe is not open on the other end (miner has stopped)
-                                log_message("Miner pipe is not open, skipping...\n");
-                                continue;
-                            } else {
-                                // Handle other errors
-                                log_message("Server: Error opening miner pipe");
-                                continue;
-                            }
-                        }
-                    writeTlvToPipe(fd_Miner, &new_block_tlv);
-                    close(fd_Miner);
+                // Replicate before logging and broadcasting so a standby never falls behind the miners.
+                // If a standby took over meanwhile, the block is handed to it instead.
+                if (!save_state(current_block, next_block, miners_Count)) {
+                    step_down(tlv);
                 }
+                last_heartbeat = now_ms();
+
+                log_message(ANSI_COLOR_YELLOW "Server:" ANSI_COLOR_RESET "New block added by %d, attributes: height:(%d), timestamp:(%d), hash:(0x%x), prev-hash:(0x%x), difficulty:(%d), nonce:(%d)\n"
+                , temp_Block->relayed_by, temp_Block->height, temp_Block->timestamp, temp_Block->hash, temp_Block->prev_hash, temp_Block->difficulty, temp_Block->nonce);
 
+                // Broadcast new block 
+                broadcast_block(next_block, miners_Count);
             }
         }
 
@@ -336,12 +431,17 @@ TLV* readTlvFromPipe(int pipeReadEnd) {
     return tlv;
 }
 
-// Serialize TLV to pipe
-void writeTlvToPipe(int pipeWriteEnd, TLV* tlv) {
+// Serialize TLV to pipe, returns the write() result
+int writeTlvToPipe(int pipeWriteEnd, TLV* tlv) {
     int len = 0;
 
     len = write(pipeWriteEnd, (void*)tlv, sizeof(tlv->type) + sizeof(tlv->length) + tlv->length);
-    if (len < 0) { log_message("type + length + value"); return; }
+    if (len < 0) {
+        int saved_errno = errno;
+        log_message("type + length + value");
+        errno = saved_errno;
+    }
+    return len;
 }
 
 void cleanup_pipes() {
@@ -366,7 +466,23 @@ void cleanup_pipes() {
 // Signal handler
 void signal_handler(int signum) {
     log_message("Received signal %d, cleaning up and exiting...\n", signum);
-    cleanup_pipes();
+    if (!is_primary) {
+        // A standby owns nothing shared, just stop waiting
+        exit(signum);
+    }
+    // Held while deciding, so a standby can't claim the state in between
+    lock_state();
+    if (is_fenced()) {
+        // A standby already took over from us, the pipes and state are its own now
+        log_message("Another server took over as primary, leaving its files in place\n");
+    } else if (standby_waiting()) {
+        // Leave the pipes and state in place for the standby to take over
+        log_message("Standby server is waiting, handing over\n");
+    } else {
+        cleanup_pipes();
+        unlink(STATE_FILE);
+    }
+    unlock_state();
     if (fd_Server != -1) {
         close(fd_Server);
     }
@@ -397,3 +513,232 @@ int read_difficulty_from_file(const char* filepath) {
 
     return difficulty;
 }
+
+// Wall-clock milliseconds, comparable between containers on the same host
+long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Take the primary lease, waiting as a standby while another server holds it.
+// The kernel drops the lock the moment the primary dies. A primary that is alive
+// but hung keeps the lock, so the standby also takes over when the heartbeat in
+// the state file stops changing, and fences the old primary with a new epoch.
+// Returns true if this server had to wait for the lease.
+bool acquire_primary_lease() {
+    fd_Lock = open(LOCK_FILE, O_RDWR | O_CREAT, 0666);
+    if (fd_Lock == -1) {
+        log_message("Error opening lock file");
+        exit(EXIT_FAILURE);
+    }
+
+    if (flock(fd_Lock, LOCK_EX | LOCK_NB) == 0) {
+        is_primary = true;
+        has_lease = true;
+        return false;
+    }
+    if (errno != EWOULDBLOCK) {
+        log_message("Error locking lock file");
+        exit(EXIT_FAILURE);
+    }
+
+    // Announce ourselves so the primary leaves its pipes behind on shutdown,
+    // kept until the state is claimed (see main)
+    fd_Standby_Lock = open(STANDBY_LOCK_FILE, O_RDWR | O_CREAT, 0666);
+    if (fd_Standby_Lock != -1) {
+        flock(fd_Standby_Lock, LOCK_SH);
+    }
+
+    log_message("Server: another server is primary, waiting in standby mode\n");
+
+    // Heartbeat age is measured on our own clock, from when we last saw it change
+    struct timespec poll = { 0, STANDBY_POLL_MS * 1000000L };
+    long last_heartbeat = -1;
+    long last_change = now_ms();
+    long last_locked = now_ms();
+    while (true) 
+    {
+        nanosleep(&poll, NULL);
+
+        // The primary held the lock at our previous poll, so it died since then
+        if (flock(fd_Lock, LOCK_EX | LOCK_NB) == 0) {
+            has_lease = true;
+            primary_alive_ms = last_locked;
+            detected_by = "lease";
+            break;
+        }
+        last_locked = now_ms();
+
+        ServerState_t state;
+        if (load_state(&state) && state.heartbeat_ms != last_heartbeat) {
+            last_heartbeat = state.heartbeat_ms;
+            last_change = now_ms();
+        }
+        if (now_ms() - last_change > HEARTBEAT_TIMEOUT_MS) {
+            log_message("Server: primary heartbeat stopped for %ld ms, taking over from a hung primary\n", now_ms() - last_change);
+            primary_alive_ms = last_change;
+            detected_by = "heartbeat";
+            break;
+        }
+    }
+    is_primary = true;
+    return true;
+}
+
+// Check whether a standby server is waiting for the lease
+bool standby_waiting() {
+    int fd_Standby = open(STANDBY_LOCK_FILE, O_RDWR | O_CREAT, 0666);
+    if (fd_Standby == -1) {
+        return false;
+    }
+    bool waiting = flock(fd_Standby, LOCK_EX | LOCK_NB) == -1 && errno == EWOULDBLOCK;
+    close(fd_Standby);
+    return waiting;
+}
+
+// Read the replicated state, returns false if there is none
+bool load_state(ServerState_t* state) {
+    int fd = open(STATE_FILE, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t len = read(fd, state, sizeof(ServerState_t));
+    close(fd);
+    return len == sizeof(ServerState_t);
+}
+
+// Lock the state file against the other server, opened on first use
+void lock_state() {
+    if (fd_State_Lock == -1) {
+        fd_State_Lock = open(STATE_LOCK_FILE, O_RDWR | O_CREAT, 0666);
+    }
+    if (fd_State_Lock != -1) {
+        flock(fd_State_Lock, LOCK_EX);
+    }
+}
+
+void unlock_state() {
+    if (fd_State_Lock != -1) {
+        flock(fd_State_Lock, LOCK_UN);
+    }
+}
+
+// Write a state to the file, temp file + rename so readers never see a partial state
+void write_state(ServerState_t* state) {
+    int fd = open(STATE_TMP_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        log_message("Error opening state file");
+        return;
+    }
+    ssize_t len = write(fd, state, sizeof(ServerState_t));
+    close(fd);
+    if (len != sizeof(ServerState_t)) {
+        log_message("Error writing state file");
+        return;
+    }
+    rename(STATE_TMP_FILE, STATE_FILE);
+}
+
+// Load the replicated state and take it over with a new epoch, fencing the previous primary.
+// Returns false if there was no state to resume from.
+bool claim_state(ServerState_t* state) {
+    lock_state();
+    bool loaded = load_state(state);
+    server_epoch = (loaded ? state->epoch : 0) + 1;
+    if (loaded) {
+        ServerState_t claimed = *state;
+        claimed.epoch = server_epoch;
+        claimed.heartbeat_ms = now_ms();
+        write_state(&claimed);
+    }
+    unlock_state();
+    return loaded;
+}
+
+// Check whether a newer primary has taken over from us
+bool is_fenced() {
+    ServerState_t state;
+    return load_state(&state) && state.epoch > server_epoch;
+}
+
+// Exit after being fenced, leaving the pipes, the state and any unhandled message to the new primary
+void step_down(TLV* pending) {
+    log_message(ANSI_COLOR_RED "Server: " ANSI_COLOR_RESET "Another server took over as primary, stepping down\n");
+    is_primary = false;
+
+    if (pending != NULL) {
+        int fd = open("/mnt/mta/server_pipe", O_WRONLY | O_NONBLOCK);
+        if (fd != -1) {
+            writeTlvToPipe(fd, pending);
+            close(fd);
+        }
+    }
+    if (fd_Server != -1) {
+        close(fd_Server);
+    }
+    exit(EXIT_FAILURE);
+}
+
+// Publish the chain tip, miner registry and a heartbeat for the standby.
+// Returns false without writing if a newer primary has fenced us.
+bool save_state(Block_t* current_block, Block_t* next_block, int miners_Count) {
+    ServerState_t state;
+    state.heartbeat_ms = now_ms();
+    state.epoch = server_epoch;
+    state.miners_Count = miners_Count;
+    memcpy(&state.current_block, current_block, sizeof(Block_t));
+    memcpy(&state.next_block, next_block, sizeof(Block_t));
+
+    lock_state();
+    if (is_fenced()) {
+        unlock_state();
+        return false;
+    }
+    write_state(&state);
+    unlock_state();
+    return true;
+}
+
+// Send a block to every registered miner
+void broadcast_block(Block_t* block, int miners_Count) {
+    TLV new_block_tlv;
+    new_block_tlv.type = NEW_BLOCK;
+    new_block_tlv.length = sizeof(Block_t);
+    memcpy(new_block_tlv.value, block, sizeof(Block_t));
+
+    for (int i = 1; i <= miners_Count; i++) 
+    {
+        char miner_pipe[32];
+        sprintf(miner_pipe, "/mnt/mta/miner_%d", i);
+        int fd_Miner = open(miner_pipe, O_WRONLY | O_NONBLOCK);
+         if (fd_Miner == -1) 
+            {
+                if (errno == ENXIO) {
+                    // The pipe is not open on the other end (miner has stopped)
+                    log_message("Miner pipe is not open, skipping...\n");
+                    continue;
+                } else {
+                    // Handle other errors
+                    log_message("Server: Error opening miner pipe");
+                    continue;
+                }
+            }
+        writeTlvToPipe(fd_Miner, &new_block_tlv);
+        close(fd_Miner);
+    }
+}
+
+// Record the last takeover on the shared volume for failover_test.sh
+void write_failover_report(long failover_ms, int height) {
+    FILE* file = fopen(FAILOVER_FILE, "w");
+    if (file == NULL) {
+        log_message("Error opening failover report");
+        return;
+    }
+    fprintf(file, "FAILOVER_MS=%ld\n", failover_ms);
+    fprintf(file, "DETECTED_BY=%s\n", detected_by);
+    fprintf(file, "EPOCH=%d\n", server_epoch);
+    fprintf(file, "HEIGHT=%d\n", height);
+    fclose(file);
+}